@@ -2,13 +2,31 @@
 #include <charconv>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <thread>
-#include <set>
+#include <tuple>
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 // clang++ -std=c++20 -stdlib=libc++ -fsanitize=thread,undefined,bounds main.cpp -o sched && ./sched
 
@@ -36,30 +54,189 @@ void print(const Args&... args) {
   print_message(args...);
 }
 
+// Fixed set of worker threads fed from one FIFO. Workers can be added and
+// retired while running, which the scheduler's watchdog uses to compensate
+// for workers stuck in an overrunning callback.
+class ThreadPool {
+public:
+  using Task = std::function<void()>;
+
+  explicit ThreadPool(size_t workers) {
+    for (size_t i = 0; i < workers; ++i) {
+      add_worker();
+    }
+  }
+
+  ~ThreadPool() {
+    shutdown();
+  }
+
+  // Runs the queued tasks to completion and joins the workers.
+  void shutdown() {
+    {
+      std::lock_guard g{mutex};
+      stopping = true;
+    }
+    condvar.notify_all();
+    for (auto& thread : threads) {
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+  }
+
+  void post(Task&& task) {
+    {
+      std::lock_guard g{mutex};
+      tasks.push_back(std::move(task));
+    }
+    condvar.notify_one();
+  }
+
+  void add_worker() {
+    std::lock_guard g{mutex};
+    if (stopping) {
+      return;
+    }
+    threads.emplace_back(&ThreadPool::work, this);
+  }
+
+  // Some worker exits once it is between tasks.
+  void retire_worker() {
+    {
+      std::lock_guard g{mutex};
+      ++retiring;
+    }
+    condvar.notify_one();
+  }
+
+private:
+  void work() {
+    std::unique_lock g{mutex};
+    while (true) {
+      condvar.wait(g, [this]() { return stopping || retiring != 0 || !tasks.empty(); });
+      if (retiring != 0) {
+        --retiring;
+        return;
+      }
+      if (tasks.empty()) {
+        return;
+      }
+      auto task = std::move(tasks.front());
+      tasks.pop_front();
+      g.unlock();
+      task();
+      g.lock();
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable condvar;
+  std::deque<Task> tasks;
+  std::vector<std::thread> threads;
+  size_t retiring = 0;
+  bool stopping = false;
+};
+
+// Callbacks that jobs refer to by index instead of owning a closure. Handlers
+// are registered up front, before any job uses them.
+class HandlerTable {
+public:
+  using Handler = void (*)(uint64_t cookie);
+  // Optional form taking every cookie of one kind that expired together.
+  using BatchHandler = void (*)(std::span<const uint64_t> cookies);
+
+  uint32_t add(Handler handler, BatchHandler batch = nullptr) {
+    handlers.push_back(Entry{handler, batch});
+    return static_cast<uint32_t>(handlers.size() - 1);
+  }
+
+  uint32_t add(BatchHandler batch) {
+    return add(nullptr, batch);
+  }
+
+  void call(uint32_t handler, uint64_t cookie) const {
+    const auto& entry = handlers[handler];
+    if (entry.single) {
+      entry.single(cookie);
+    } else {
+      entry.batch(std::span{&cookie, 1});
+    }
+  }
+
+  void call_each(uint32_t handler, std::span<const uint64_t> cookies) const {
+    const auto& entry = handlers[handler];
+    if (entry.batch) {
+      entry.batch(cookies);
+      return;
+    }
+    for (auto cookie : cookies) {
+      entry.single(cookie);
+    }
+  }
+
+private:
+  struct Entry {
+    Handler single;
+    BatchHandler batch;
+  };
+
+  std::vector<Entry> handlers;
+};
+
 template<typename Time>
 class Scheduler {
 public:
   using Fn = std::function<void()>;
   using Ms = std::chrono::milliseconds;
 
+  static constexpr uint32_t NO_HANDLER = std::numeric_limits<uint32_t>::max();
+
   struct Job {
     size_t id;
     Fn fn;
     TimePoint launch_at;
     bool canceled;
+    // Zero falls back to Options::budget.
+    std::chrono::nanoseconds budget{0};
+    // Typed jobs call handler of Options::handlers with arg instead of fn.
+    uint32_t handler = NO_HANDLER;
+    uint64_t arg = 0;
 
     bool operator<(const Job& rhs) const {
       return launch_at < rhs.launch_at;
     }
   };
 
-  struct JobComparator {
-    bool operator()(const std::shared_ptr<Job>& lhs, const std::shared_ptr<Job>& rhs) const {
-      return *lhs < *rhs;
-    }
+  // What schedule() does with a job that is already due.
+  enum class Immediate {
+    Queue,     // same path as future jobs
+    RunQueue,  // lock-free hand-off to the execution thread
+    Inline,    // run on the caller, concurrently with the execution thread
   };
 
-  Scheduler(Time& time) : time{time} {
+  struct Options {
+    Immediate immediate = Immediate::RunQueue;
+    // Deadlines are rounded up to a multiple of tick and all jobs of one tick
+    // are fired together; zero keeps the clock's own resolution.
+    std::chrono::nanoseconds tick{0};
+    // Callbacks run on this many pool threads instead of the execution thread.
+    size_t workers = 0;
+    // Execution budget of a callback unless the job has its own, zero is none.
+    std::chrono::nanoseconds budget{0};
+    // Period of the watchdog thread checking budgets, zero disables it.
+    std::chrono::milliseconds watchdog{0};
+    // Handlers of typed jobs, must outlive the scheduler.
+    const HandlerTable* handlers = nullptr;
+  };
+
+  Scheduler(Time& time, Options options = {}) : time{time}, options{options} {
+    if (options.workers != 0) {
+      pool = std::make_unique<ThreadPool>(options.workers);
+    }
+    if (options.watchdog.count() != 0) {
+      watchdog = std::thread{&Scheduler::watch, this};
+    }
     execution_thread = std::thread{&Scheduler::loop, this};
   }
 
@@ -67,19 +244,38 @@ public:
     if (execution_thread.joinable()) {
       execution_thread.join();
     }
+    if (pool) {
+      pool->shutdown();
+    }
+    if (watchdog.joinable()) {
+      {
+        std::lock_guard g{running_mutex};
+        watchdog_stopped = true;
+      }
+      watchdog_condvar.notify_one();
+      watchdog.join();
+    }
+    pool.reset();
+    for (auto node = ready.load(); node != nullptr;) {
+      delete std::exchange(node, node->next);
+    }
   }
 
-  std::weak_ptr<Job> schedule(size_t id, Fn&& fn, TimePoint at) {
-    std::lock_guard g{jobs_mutex};
-    auto ptr = std::make_shared<Job>(id, std::move(fn), at, false);
-    jobs.insert(ptr);
-    jobs_condvar.notify_one();
-    return std::weak_ptr<Job>{ptr};
+  std::weak_ptr<Job> schedule(
+      size_t id, Fn&& fn, TimePoint at, std::chrono::nanoseconds budget = {}) {
+    return enqueue(Job{id, std::move(fn), at, false, budget});
+  }
+
+  // Capture-free job. Typed jobs that fall due together are grouped by
+  // handler and each handler is called once over the array of their args.
+  std::weak_ptr<Job> schedule(size_t id, uint32_t handler, uint64_t arg, TimePoint at) {
+    assert(options.handlers != nullptr);
+    return enqueue(Job{id, Fn{}, at, false, std::chrono::nanoseconds{0}, handler, arg});
   }
 
   bool done() {
     std::lock_guard g{jobs_mutex};
-    return jobs.empty();
+    return jobs.empty() && ready.load() == nullptr;
   }
 
   void cancel(std::weak_ptr<Job>&& handle) {
@@ -91,9 +287,189 @@ public:
   }
 
 private:
+  struct ReadyNode {
+    std::shared_ptr<Job> job;
+    ReadyNode* next;
+  };
+
+  // A callback currently executing, as seen by the watchdog.
+  struct Running {
+    size_t id;
+    std::chrono::steady_clock::time_point started;
+    std::chrono::nanoseconds budget;
+    bool active;
+    bool reported;
+    bool compensated;
+  };
+
+  TimePoint quantize(TimePoint at) const {
+    if (options.tick.count() == 0) {
+      return at;
+    }
+    const auto since_epoch = at.time_since_epoch() + options.tick - std::chrono::nanoseconds{1};
+    return TimePoint{since_epoch / options.tick * options.tick};
+  }
+
+  std::weak_ptr<Job> enqueue(Job&& job) {
+    if (options.immediate != Immediate::Queue) {
+      const auto now = time.now();
+      if (job.launch_at <= now) {
+        job.launch_at = now;
+        return schedule_immediate(std::move(job), now);
+      }
+    }
+    job.launch_at = quantize(job.launch_at);
+    std::lock_guard g{jobs_mutex};
+    auto ptr = std::make_shared<Job>(std::move(job));
+    jobs[ptr->launch_at].push_back(ptr);
+    jobs_condvar.notify_one();
+    return std::weak_ptr<Job>{ptr};
+  }
+
+  std::weak_ptr<Job> schedule_immediate(Job&& job, TimePoint now) {
+    if (options.immediate == Immediate::Inline) {
+      if (job.handler == NO_HANDLER) {
+        job.fn();
+      } else {
+        options.handlers->call(job.handler, job.arg);
+      }
+      std::lock_guard g{jobs_mutex};
+      got[job.id] = now;
+      return {};
+    }
+    auto node = new ReadyNode{std::make_shared<Job>(std::move(job)), nullptr};
+    auto handle = std::weak_ptr<Job>{node->job};
+    node->next = ready.load(std::memory_order_relaxed);
+    while (!ready.compare_exchange_weak(node->next, node)) {
+    }
+    // Pairs with the sleeping/ready check in execute_pending(): either the
+    // executor sees the node before it waits, or we see it sleeping.
+    if (sleeping.load()) {
+      std::lock_guard g{jobs_mutex};
+      jobs_condvar.notify_one();
+    }
+    return handle;
+  }
+
+  void execute_ready(const TimePoint& now) {
+    auto node = ready.exchange(nullptr);
+    ReadyNode* fifo = nullptr;
+    while (node != nullptr) {
+      fifo = std::exchange(node, std::exchange(node->next, fifo));
+    }
+    auto due = std::vector<std::shared_ptr<Job>>{};
+    while (fifo != nullptr) {
+      due.push_back(std::move(fifo->job));
+      delete std::exchange(fifo, fifo->next);
+    }
+    dispatch(due, now);
+  }
+
+  void dispatch(const std::vector<std::shared_ptr<Job>>& due, const TimePoint& now) {
+    for (const auto& job : due) {
+      if (job->canceled) {
+        continue;
+      }
+      if (job->handler == NO_HANDLER) {
+        run(job, now);
+      } else {
+        typed.push_back(job.get());
+      }
+    }
+    if (typed.empty()) {
+      return;
+    }
+    std::stable_sort(typed.begin(), typed.end(), [](const Job* lhs, const Job* rhs) {
+      return lhs->handler < rhs->handler;
+    });
+    for (auto first = typed.begin(); first != typed.end();) {
+      args.clear();
+      auto last = first;
+      for (; last != typed.end() && (*last)->handler == (*first)->handler; ++last) {
+        print("Executing ", (*last)->id, " at ", now.time_since_epoch().count(), '\n');
+        got[(*last)->id] = now;
+        args.push_back((*last)->arg);
+      }
+      run_batch((*first)->id, (*first)->handler, args);
+      first = last;
+    }
+    typed.clear();
+  }
+
+  void run(const std::shared_ptr<Job>& job, const TimePoint& now) {
+    print("Executing ", job->id, " at ", now.time_since_epoch().count(), '\n');
+    got[job->id] = now;
+    const auto budget = job->budget.count() != 0 ? job->budget : options.budget;
+    if (pool) {
+      pool->post([this, job, budget]() { run_tracked(job->id, budget, job->fn); });
+    } else {
+      run_tracked(job->id, budget, job->fn);
+    }
+  }
+
+  void run_batch(size_t id, uint32_t handler, std::span<const uint64_t> batch) {
+    if (pool) {
+      pool->post([this, id, handler, batch = std::vector<uint64_t>(batch.begin(), batch.end())]() {
+        run_tracked(id, options.budget, [&]() { options.handlers->call_each(handler, batch); });
+      });
+    } else {
+      run_tracked(id, options.budget, [&]() { options.handlers->call_each(handler, batch); });
+    }
+  }
+
+  // A batch of typed jobs is reported to the watchdog by its first job id.
+  template<typename F>
+  void run_tracked(size_t id, std::chrono::nanoseconds budget, F&& fn) {
+    if (!watchdog.joinable() || budget.count() == 0) {
+      fn();
+      return;
+    }
+    size_t slot;
+    {
+      std::lock_guard g{running_mutex};
+      if (free_running.empty()) {
+        free_running.push_back(running.size());
+        running.emplace_back();
+      }
+      slot = free_running.back();
+      free_running.pop_back();
+      running[slot] = Running{id, std::chrono::steady_clock::now(), budget, true, false, false};
+    }
+    fn();
+    std::lock_guard g{running_mutex};
+    running[slot].active = false;
+    free_running.push_back(slot);
+    if (running[slot].compensated) {
+      pool->retire_worker();
+    }
+  }
+
+  void watch() {
+    std::unique_lock g{running_mutex};
+    while (!watchdog_stopped) {
+      watchdog_condvar.wait_for(g, options.watchdog);
+      const auto now = std::chrono::steady_clock::now();
+      for (auto& record : running) {
+        if (!record.active || record.reported || now - record.started <= record.budget) {
+          continue;
+        }
+        record.reported = true;
+        {
+          std::lock_guard c{cout_mutex};
+          std::cerr << "job " << record.id << " overran its budget of " << record.budget.count()
+                    << "ns" << std::endl;
+        }
+        if (pool) {
+          pool->add_worker();
+          record.compensated = true;
+        }
+      }
+    }
+  }
+
   void loop() {
     while (true) {
-      if (done() && no_tasks_left) {
+      if (no_tasks_left && done()) {
         break;
       }
       execute_pending(time.now());
@@ -102,29 +478,538 @@ private:
 
   void execute_pending(const std::chrono::steady_clock::time_point& now) {
     std::unique_lock g{jobs_mutex};
+    execute_ready(now);
     while (!jobs.empty()) {
       auto it = jobs.begin();
-      auto ptr = it->get();
-      if (ptr->canceled) {
-        jobs.erase(it);
-        continue;
-      }
-      if (ptr->launch_at > now) {
-        jobs_condvar.wait_until(g, ptr->launch_at);
+      if (it->first > now) {
+        sleeping.store(true);
+        if (ready.load() == nullptr) {
+          jobs_condvar.wait_until(g, it->first);
+        }
+        sleeping.store(false);
         return;
       }
-      print("Executing ", ptr->id, " at ", now.time_since_epoch().count(), '\n');
-      got[ptr->id] = now;
-      ptr->fn();
+      const auto bucket = std::move(it->second);
       jobs.erase(it);
+      dispatch(bucket, now);
     }
   }
 
   std::mutex jobs_mutex;
   std::condition_variable jobs_condvar;
-  std::set<std::shared_ptr<Job>, JobComparator> jobs;
+  // One bucket per distinct (quantized) deadline.
+  std::map<TimePoint, std::vector<std::shared_ptr<Job>>> jobs;
+  std::atomic<ReadyNode*> ready = nullptr;
+  std::atomic_bool sleeping = false;
+  // Scratch space of dispatch(), only touched by the execution thread.
+  std::vector<Job*> typed;
+  std::vector<uint64_t> args;
+  std::unique_ptr<ThreadPool> pool;
+  std::mutex running_mutex;
+  std::condition_variable watchdog_condvar;
+  std::vector<Running> running;
+  std::vector<size_t> free_running;
+  bool watchdog_stopped = false;
+  std::thread watchdog;
   std::thread execution_thread;
   Time& time;
+  Options options;
+};
+
+// Deadline in wheel ticks since the wheel epoch (wrapping), handler index and
+// a user cookie in place of captured state.
+struct CompactTimer {
+  uint32_t deadline;
+  uint32_t handler;
+  uint64_t cookie;
+};
+
+static_assert(sizeof(CompactTimer) == 16);
+
+// Hierarchical timing wheel of CompactTimer for large numbers of mostly idle,
+// fire-and-forget timers. Four levels of 256 slots cover the whole 32-bit tick
+// range; a timer is cascaded to a finer level when its slot comes up. There is
+// no cancel, handlers are expected to validate the cookie (e.g. a generation)
+// instead. The wheel is driven by calling advance().
+template<typename Time>
+class CompactTimerWheel {
+public:
+  CompactTimerWheel(
+      Time& time,
+      const HandlerTable& handlers,
+      std::chrono::nanoseconds resolution = std::chrono::milliseconds{1})
+      : time{time}, handlers{handlers}, resolution{resolution}, epoch{time.now()} {}
+
+  void schedule(uint32_t handler, uint64_t cookie, TimePoint at) {
+    // Deadlines past the 32-bit horizon fire at the horizon.
+    at = std::min(at, time.now() + resolution * HORIZON);
+    const auto ticks = (at - epoch + resolution - std::chrono::nanoseconds{1}) / resolution;
+    std::lock_guard g{mutex};
+    insert(CompactTimer{static_cast<uint32_t>(ticks), handler, cookie});
+    ++pending;
+  }
+
+  // Fires every timer due by now, returns how many fired.
+  size_t advance() {
+    const auto target = static_cast<uint32_t>((time.now() - epoch) / resolution);
+    auto firing = std::vector<CompactTimer>{};
+    {
+      std::lock_guard g{mutex};
+      if (pending == 0) {
+        current = target + 1;
+        return 0;
+      }
+      while (static_cast<int32_t>(target - current) >= 0) {
+        expire(current);
+        ++current;
+      }
+      pending -= fired.size();
+      firing.swap(fired);
+    }
+    std::stable_sort(firing.begin(), firing.end(), [](const auto& lhs, const auto& rhs) {
+      return lhs.handler < rhs.handler;
+    });
+    auto cookies = std::vector<uint64_t>{};
+    for (auto first = firing.begin(); first != firing.end();) {
+      cookies.clear();
+      auto last = first;
+      for (; last != firing.end() && last->handler == first->handler; ++last) {
+        cookies.push_back(last->cookie);
+      }
+      handlers.call_each(first->handler, cookies);
+      first = last;
+    }
+    return firing.size();
+  }
+
+  size_t size() {
+    std::lock_guard g{mutex};
+    return pending;
+  }
+
+private:
+  static constexpr uint32_t LEVELS = 4;
+  static constexpr uint32_t SLOTS = 256;
+  static constexpr uint32_t HORIZON = 0xff000000;
+
+  void insert(CompactTimer timer) {
+    auto delta = timer.deadline - current;
+    if (static_cast<int32_t>(delta) < 0) {
+      timer.deadline = current;
+      delta = 0;
+    }
+    auto level = uint32_t{0};
+    while (level + 1 < LEVELS && delta >= 1u << (8 * (level + 1))) {
+      ++level;
+    }
+    wheel[level][(timer.deadline >> (8 * level)) % SLOTS].push_back(timer);
+  }
+
+  void expire(uint32_t tick) {
+    for (auto level = LEVELS - 1; level != 0; --level) {
+      if ((tick & ((1u << (8 * level)) - 1)) != 0) {
+        continue;
+      }
+      auto cascaded = std::vector<CompactTimer>{};
+      cascaded.swap(wheel[level][(tick >> (8 * level)) % SLOTS]);
+      for (const auto& timer : cascaded) {
+        insert(timer);
+      }
+    }
+    auto& slot = wheel[0][tick % SLOTS];
+    fired.insert(fired.end(), slot.begin(), slot.end());
+    slot.clear();
+  }
+
+  Time& time;
+  const HandlerTable& handlers;
+  std::chrono::nanoseconds resolution;
+  TimePoint epoch;
+  std::mutex mutex;
+  std::array<std::array<std::vector<CompactTimer>, SLOTS>, LEVELS> wheel;
+  // Next tick to expire.
+  uint32_t current = 0;
+  size_t pending = 0;
+  std::vector<CompactTimer> fired;
+};
+
+// Token bucket on top of Scheduler. Tokens are refilled lazily from the clock
+// on every call, so a limiter that keeps up never touches the scheduler; only
+// the transition from "token available" to "someone is waiting" arms a single
+// wake-up job, which re-arms itself while waiters remain. A burst of 1 makes
+// it a leaky bucket.
+template<typename Time>
+class RateLimiter {
+public:
+  using Fn = typename Scheduler<Time>::Fn;
+
+  RateLimiter(Scheduler<Time>& scheduler, Time& time, size_t id, double rate, double burst)
+      : scheduler{scheduler}, time{time}, id{id}, rate{rate}, burst{burst}, tokens{burst},
+        refilled{time.now()} {}
+
+  // Pending wake-ups must not run past the limiter's lifetime.
+  ~RateLimiter() {
+    std::lock_guard g{mutex};
+    if (armed) {
+      scheduler.cancel(std::move(wakeup));
+    }
+  }
+
+  bool try_acquire() {
+    std::lock_guard g{mutex};
+    refill();
+    if (!waiters.empty() || tokens < 1) {
+      return false;
+    }
+    tokens -= 1;
+    return true;
+  }
+
+  // Runs fn on the caller if a token is available right away, otherwise from
+  // the scheduler once one is, in FIFO order with other waiters.
+  void acquire(Fn&& fn) {
+    {
+      std::lock_guard g{mutex};
+      refill();
+      if (!waiters.empty() || tokens < 1) {
+        waiters.push_back(std::move(fn));
+        if (!armed) {
+          arm();
+        }
+        return;
+      }
+      tokens -= 1;
+    }
+    fn();
+  }
+
+private:
+  void refill() {
+    const auto now = time.now();
+    const auto elapsed = std::chrono::duration<double>(now - refilled).count();
+    tokens = std::min(burst, tokens + elapsed * rate);
+    refilled = now;
+  }
+
+  void arm() {
+    const auto wait = std::chrono::duration<double>((1 - tokens) / rate);
+    const auto at = refilled + std::chrono::ceil<std::chrono::nanoseconds>(wait);
+    wakeup = scheduler.schedule(id, [this]() { wake(); }, at);
+    armed = true;
+  }
+
+  void wake() {
+    auto runnable = std::vector<Fn>{};
+    {
+      std::lock_guard g{mutex};
+      refill();
+      while (!waiters.empty() && tokens >= 1) {
+        tokens -= 1;
+        runnable.push_back(std::move(waiters.front()));
+        waiters.pop_front();
+      }
+      armed = false;
+      if (!waiters.empty()) {
+        arm();
+      }
+    }
+    for (auto& fn : runnable) {
+      fn();
+    }
+  }
+
+  Scheduler<Time>& scheduler;
+  Time& time;
+  size_t id;
+  double rate;
+  double burst;
+  std::mutex mutex;
+  double tokens;
+  TimePoint refilled;
+  std::deque<Fn> waiters;
+  std::weak_ptr<typename Scheduler<Time>::Job> wakeup;
+  bool armed = false;
+};
+
+inline long futex(std::atomic<uint32_t>* word, int op, uint32_t val, const timespec* ts = nullptr) {
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t));
+  return syscall(
+      SYS_futex, reinterpret_cast<uint32_t*>(word), op, val, ts, nullptr, FUTEX_BITSET_MATCH_ANY);
+}
+
+// Mutex that may be placed in memory mapped by several processes, so the futex
+// calls must not use FUTEX_PRIVATE_FLAG. 0 - unlocked, 1 - locked, 2 - contended.
+class SharedMutex {
+public:
+  void lock() {
+    uint32_t c = 0;
+    if (state.compare_exchange_strong(c, 1, std::memory_order_acquire)) {
+      return;
+    }
+    if (c != 2) {
+      c = state.exchange(2, std::memory_order_acquire);
+    }
+    while (c != 0) {
+      futex(&state, FUTEX_WAIT, 2);
+      c = state.exchange(2, std::memory_order_acquire);
+    }
+  }
+
+  void unlock() {
+    if (state.exchange(0, std::memory_order_release) == 2) {
+      futex(&state, FUTEX_WAKE, 1);
+    }
+  }
+
+private:
+  std::atomic<uint32_t> state{0};
+};
+
+// Scheduler whose job slab and deadline heap live in a POSIX shared-memory
+// segment. Every process on the host may schedule and cancel, only the owner
+// runs the timer thread and fires callbacks, looked up by type id in its own
+// registry since code pointers mean nothing across address spaces.
+template<typename Time>
+class SharedScheduler {
+public:
+  using Fn = std::function<void(size_t id, uint64_t arg)>;
+
+  struct Handle {
+    uint32_t slot;
+    uint32_t generation;
+  };
+
+  SharedScheduler(Time& time, std::string name, uint32_t capacity, bool owner)
+      : time{time}, name{std::move(name)}, owner{owner} {
+    const auto flags = owner ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR;
+    fd = shm_open(this->name.c_str(), flags, 0600);
+    assert(fd >= 0);
+    if (owner) {
+      size = sizeof(Segment) + capacity * (sizeof(Slot) + sizeof(uint32_t));
+      [[maybe_unused]] auto err = ftruncate(fd, static_cast<off_t>(size));
+      assert(err == 0);
+    } else {
+      auto header = Segment{};
+      [[maybe_unused]] auto read = pread(fd, &header, sizeof(header), 0);
+      assert(read == sizeof(header) && header.magic == Segment::MAGIC);
+      size = sizeof(Segment) + header.capacity * (sizeof(Slot) + sizeof(uint32_t));
+    }
+    auto mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(mem != MAP_FAILED);
+    segment = static_cast<Segment*>(mem);
+    slots = reinterpret_cast<Slot*>(segment + 1);
+    if (owner) {
+      heap = reinterpret_cast<uint32_t*>(slots + capacity);
+      new (segment) Segment{};
+      segment->capacity = capacity;
+      for (uint32_t i = 0; i < capacity; ++i) {
+        slots[i] = Slot{.next_free = i + 1};
+      }
+      segment->magic = Segment::MAGIC;
+      execution_thread = std::thread{&SharedScheduler::loop, this};
+    } else {
+      heap = reinterpret_cast<uint32_t*>(slots + segment->capacity);
+    }
+  }
+
+  ~SharedScheduler() {
+    if (owner) {
+      segment->stopped.store(1);
+      wake();
+      if (execution_thread.joinable()) {
+        execution_thread.join();
+      }
+      shm_unlink(name.c_str());
+    }
+    munmap(segment, size);
+    close(fd);
+  }
+
+  // Only meaningful in the owner, which is the process that fires callbacks.
+  void register_type(uint32_t type, Fn&& fn) {
+    std::lock_guard g{types_mutex};
+    if (types.size() <= type) {
+      types.resize(type + 1);
+    }
+    types[type] = std::move(fn);
+  }
+
+  std::optional<Handle> schedule(size_t id, uint32_t type, uint64_t arg, TimePoint at) {
+    std::lock_guard g{segment->mutex};
+    if (segment->free_head == segment->capacity) {
+      return std::nullopt;
+    }
+    const auto index = segment->free_head;
+    auto& slot = slots[index];
+    segment->free_head = slot.next_free;
+    slot.launch_at = at.time_since_epoch().count();
+    slot.id = id;
+    slot.arg = arg;
+    slot.type = type;
+    slot.pending = true;
+    slot.heap_index = segment->heap_size++;
+    heap[slot.heap_index] = index;
+    sift_up(slot.heap_index);
+    if (heap[0] == index) {
+      wake();
+    }
+    return Handle{index, slot.generation};
+  }
+
+  bool done() {
+    std::lock_guard g{segment->mutex};
+    return segment->heap_size == 0;
+  }
+
+  void cancel(Handle handle) {
+    std::lock_guard g{segment->mutex};
+    auto& slot = slots[handle.slot];
+    if (!slot.pending || slot.generation != handle.generation) {
+      return;
+    }
+    remove(slot.heap_index);
+  }
+
+private:
+  struct Slot {
+    int64_t launch_at;
+    uint64_t id;
+    uint64_t arg;
+    uint32_t type;
+    uint32_t generation;
+    uint32_t heap_index;
+    uint32_t next_free;
+    bool pending;
+  };
+
+  struct alignas(64) Segment {
+    static constexpr uint32_t MAGIC = 0x53434844;
+
+    uint32_t magic = 0;
+    uint32_t capacity = 0;
+    SharedMutex mutex;
+    // Bumped whenever the earliest deadline may have moved, the timer thread
+    // futex-waits on it with the earliest deadline as an absolute timeout.
+    std::atomic<uint32_t> wakeups{0};
+    std::atomic<uint32_t> stopped{0};
+    uint32_t free_head = 0;
+    uint32_t heap_size = 0;
+  };
+
+  struct Fired {
+    size_t id;
+    uint32_t type;
+    uint64_t arg;
+  };
+
+  void loop() {
+    auto fired = std::vector<Fired>{};
+    while (!segment->stopped.load()) {
+      segment->mutex.lock();
+      const auto now = time.now().time_since_epoch().count();
+      while (segment->heap_size != 0 && slots[heap[0]].launch_at <= now) {
+        const auto& slot = slots[heap[0]];
+        fired.push_back(Fired{slot.id, slot.type, slot.arg});
+        remove(0);
+      }
+      auto next = std::optional<int64_t>{};
+      if (segment->heap_size != 0) {
+        next = slots[heap[0]].launch_at;
+      }
+      const auto seq = segment->wakeups.load();
+      segment->mutex.unlock();
+
+      if (!fired.empty()) {
+        std::lock_guard g{types_mutex};
+        for (const auto& job : fired) {
+          if (job.type < types.size() && types[job.type]) {
+            types[job.type](job.id, job.arg);
+          }
+        }
+        fired.clear();
+        continue;
+      }
+      if (next) {
+        const auto ts = timespec{
+            static_cast<time_t>(*next / 1'000'000'000), static_cast<long>(*next % 1'000'000'000)};
+        futex(&segment->wakeups, FUTEX_WAIT_BITSET, seq, &ts);
+      } else {
+        futex(&segment->wakeups, FUTEX_WAIT_BITSET, seq);
+      }
+    }
+  }
+
+  void wake() {
+    segment->wakeups.fetch_add(1);
+    futex(&segment->wakeups, FUTEX_WAKE, 1);
+  }
+
+  void remove(uint32_t position) {
+    const auto index = heap[position];
+    auto& slot = slots[index];
+    slot.pending = false;
+    ++slot.generation;
+    slot.next_free = segment->free_head;
+    segment->free_head = index;
+
+    const auto last = --segment->heap_size;
+    if (position == last) {
+      return;
+    }
+    heap[position] = heap[last];
+    slots[heap[position]].heap_index = position;
+    sift_up(position);
+    sift_down(slots[heap[position]].heap_index);
+  }
+
+  bool earlier(uint32_t lhs, uint32_t rhs) const {
+    return slots[heap[lhs]].launch_at < slots[heap[rhs]].launch_at;
+  }
+
+  void swap(uint32_t lhs, uint32_t rhs) {
+    std::swap(heap[lhs], heap[rhs]);
+    slots[heap[lhs]].heap_index = lhs;
+    slots[heap[rhs]].heap_index = rhs;
+  }
+
+  void sift_up(uint32_t position) {
+    while (position != 0) {
+      const auto parent = (position - 1) / 2;
+      if (!earlier(position, parent)) {
+        break;
+      }
+      swap(position, parent);
+      position = parent;
+    }
+  }
+
+  void sift_down(uint32_t position) {
+    while (true) {
+      auto smallest = position;
+      for (auto child : {2 * position + 1, 2 * position + 2}) {
+        if (child < segment->heap_size && earlier(child, smallest)) {
+          smallest = child;
+        }
+      }
+      if (smallest == position) {
+        break;
+      }
+      swap(position, smallest);
+      position = smallest;
+    }
+  }
+
+  Time& time;
+  std::string name;
+  bool owner;
+  int fd = -1;
+  size_t size = 0;
+  Segment* segment = nullptr;
+  Slot* slots = nullptr;
+  uint32_t* heap = nullptr;
+  std::mutex types_mutex;
+  std::vector<Fn> types;
+  std::thread execution_thread;
 };
 
 struct FakeTime {
@@ -162,7 +1047,186 @@ struct Task {
   Scheduler<FakeTime>::Ms wait_for;
 };
 
-int main() {
+// End-to-end latency of zero-delay jobs: one job in flight at a time, measured
+// from the schedule() call to the start of its callback.
+int bench_immediate() {
+  using Immediate = Scheduler<RealTime>::Immediate;
+  constexpr size_t ROUNDS = 10000;
+  auto time = RealTime{};
+
+  for (auto [mode, name] : {std::pair{Immediate::Queue, "queue"},
+                            std::pair{Immediate::RunQueue, "run-queue"},
+                            std::pair{Immediate::Inline, "inline"}}) {
+    auto latencies = std::vector<std::chrono::nanoseconds>{};
+    latencies.reserve(ROUNDS);
+    no_tasks_left = false;
+    {
+      auto s = Scheduler{time, {.immediate = mode}};
+      for (size_t i = 0; i < ROUNDS; ++i) {
+        auto fired = std::atomic_bool{false};
+        const auto start = time.now();
+        s.schedule(
+            i,
+            [&]() {
+              latencies.push_back(time.now() - start);
+              fired = true;
+            },
+            start);
+        while (!fired) {
+          std::this_thread::sleep_for(std::chrono::microseconds{10});
+        }
+      }
+      no_tasks_left = true;
+    }
+    got.clear();
+
+    std::sort(latencies.begin(), latencies.end());
+    auto total = std::chrono::nanoseconds{};
+    for (auto latency : latencies) {
+      total += latency;
+    }
+    std::cout << name << ": mean " << (total / ROUNDS).count() << "ns p50 "
+              << latencies[ROUNDS / 2].count() << "ns p99 " << latencies[ROUNDS * 99 / 100].count()
+              << "ns" << std::endl;
+  }
+  return 0;
+}
+
+// Hardware and software counters of one thread, opened through
+// perf_event_open. Counters the kernel or the hypervisor refuses are skipped,
+// so the harness still runs on boxes without a PMU.
+class PerfCounters {
+public:
+  struct Sample {
+    const char* name;
+    std::optional<uint64_t> value;
+  };
+
+  explicit PerfCounters(pid_t tid = 0) {
+    constexpr std::tuple<const char*, uint32_t, uint64_t> EVENTS[] = {
+        {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    };
+    for (auto [name, type, config] : EVENTS) {
+      auto attr = perf_event_attr{};
+      attr.size = sizeof(attr);
+      attr.type = type;
+      attr.config = config;
+      attr.disabled = 1;
+      attr.exclude_hv = 1;
+      auto fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0));
+      if (fd < 0) {
+        // perf_event_paranoid >= 2 only allows user-space counting.
+        attr.exclude_kernel = 1;
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0));
+      }
+      counters.emplace_back(name, fd);
+    }
+  }
+
+  ~PerfCounters() {
+    for (auto [name, fd] : counters) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+
+  void start() {
+    for (auto [name, fd] : counters) {
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+  }
+
+  std::vector<Sample> stop() {
+    auto samples = std::vector<Sample>{};
+    for (auto [name, fd] : counters) {
+      auto value = uint64_t{};
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      }
+      if (fd >= 0 && read(fd, &value, sizeof(value)) == sizeof(value)) {
+        samples.push_back(Sample{name, value});
+      } else {
+        samples.push_back(Sample{name, std::nullopt});
+      }
+    }
+    return samples;
+  }
+
+private:
+  std::vector<std::pair<const char*, int>> counters;
+};
+
+void report_per_op(const char* op, const std::vector<PerfCounters::Sample>& samples, size_t ops) {
+  std::cout << op << " (" << ops << " ops):";
+  for (const auto& sample : samples) {
+    std::cout << ' ' << sample.name << ' ';
+    if (sample.value) {
+      std::cout << static_cast<double>(*sample.value) / static_cast<double>(ops);
+    } else {
+      std::cout << "n/a";
+    }
+  }
+  std::cout << std::endl;
+}
+
+// Per-operation counter costs of schedule(), cancel() and one execute_pending()
+// batch. The execution thread is measured by its tid, learnt from a job.
+int bench_perf() {
+  constexpr size_t JOBS = 100000;
+  auto time = RealTime{};
+  auto handles = std::vector<std::weak_ptr<Scheduler<RealTime>::Job>>{};
+  handles.reserve(JOBS);
+  no_tasks_left = false;
+  {
+    auto s = Scheduler{time};
+    auto executor_tid = std::atomic<pid_t>{0};
+    s.schedule(JOBS, [&]() { executor_tid = static_cast<pid_t>(syscall(SYS_gettid)); }, time.now());
+    while (executor_tid == 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds{10});
+    }
+
+    auto counters = PerfCounters{};
+    const auto launch_at = time.now() + std::chrono::milliseconds{500};
+    counters.start();
+    for (size_t i = 0; i < JOBS; ++i) {
+      handles.push_back(s.schedule(i, []() {}, launch_at + std::chrono::nanoseconds{i}));
+    }
+    report_per_op("schedule", counters.stop(), JOBS);
+
+    counters.start();
+    for (size_t i = 0; i < JOBS; i += 2) {
+      s.cancel(std::move(handles[i]));
+    }
+    report_per_op("cancel", counters.stop(), JOBS / 2);
+
+    auto executor = PerfCounters{executor_tid};
+    executor.start();
+    while (!s.done()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+    report_per_op("execute_pending", executor.stop(), JOBS - JOBS / 2);
+    no_tasks_left = true;
+  }
+  got.clear();
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && std::string{argv[1]} == "immediate") {
+    return bench_immediate();
+  }
+  if (argc > 1 && std::string{argv[1]} == "perf") {
+    return bench_perf();
+  }
+
   auto time = RealTime{};
 
   auto handles = std::vector<std::weak_ptr<Scheduler<RealTime>::Job>>{};